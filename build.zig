@@ -10,6 +10,8 @@ const c_source_files = [_][:0]const u8{
     "src/lndir.c",
     "src/string_list.c",
     "src/dir_walker.c",
+    "src/journal.c",
+    "src/watch.c",
 };
 const c_main_file = "src/main.c";
 
@@ -69,8 +71,12 @@ pub fn build(b: *std.Build) void {
 
     const string_mod = translate_c_file(b, optimize, target, "src/string_list.h");
     const lndir_mod = translate_c_file(b, optimize, target, "src/lndir.h");
+    const journal_mod = translate_c_file(b, optimize, target, "src/journal.h");
+    const watch_mod = translate_c_file(b, optimize, target, "src/watch.h");
     test_mod.addImport("string_list", string_mod);
     test_mod.addImport("lndir", lndir_mod);
+    test_mod.addImport("journal", journal_mod);
+    test_mod.addImport("watch", watch_mod);
 
     const exe_unit_tests = b.addTest(.{ .root_module = test_mod, .filters = test_filters });
     const run_exe_unit_tests = b.addRunArtifact(exe_unit_tests);
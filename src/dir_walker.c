@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
@@ -38,21 +39,43 @@ unsigned int append_path(char* source_path, unsigned int source_path_len, const
     return new_len;
 }
 
-static simple_ftw_sig recurse_simple_ftw(char* path, unsigned int path_len, int depth, simple_ftw_callback_t cb, void* userdata) {
-    if (depth >= MAX_DEPTH) return S_FTW_CONTINUE;
+static simple_ftw_sig recurse_simple_ftw(
+    char* path, unsigned int path_len, int depth, simple_ftw_callback_t cb, simple_ftw_error_callback_t error_cb, void* userdata) {
     path[path_len] = 0;
+    if (depth >= MAX_DEPTH) {
+        if (error_cb) error_cb(path, ENAMETOOLONG, userdata);
+        return S_FTW_CONTINUE;
+    }
 
     DIR* dir = opendir(path);
-    if (dir == NULL) return S_FTW_CONTINUE;
+    if (dir == NULL) {
+        if (error_cb) error_cb(path, errno, userdata);
+        return S_FTW_CONTINUE;
+    }
 
     debug_printf("ftw start: '%s'\n", path);
     struct dirent* ent;
 
-    while ((ent = readdir(dir)) != NULL) {
+    while (true) {
+        // readdir only sets errno on failure
+        errno = 0;
+        ent = readdir(dir);
+        if (ent == NULL) {
+            if (errno != 0 && error_cb) {
+                path[path_len] = 0;
+                error_cb(path, errno, userdata);
+            }
+            break;
+        }
+
         int new_len = append_path(path, path_len, ent->d_name);
         debug_printf("ftw path: '%s' / '%s'\n", path, ent->d_name);
-        if (new_len <= path_len) continue;
         if (!is_valid_path(ent->d_name)) continue;
+        if (new_len <= path_len) {
+            path[path_len] = 0;
+            if (error_cb) error_cb(path, ENAMETOOLONG, userdata);
+            continue;
+        }
 
         if (cb) {
             switch (cb(ent, path, new_len, userdata)) {
@@ -67,7 +90,7 @@ static simple_ftw_sig recurse_simple_ftw(char* path, unsigned int path_len, int
         } 
 
         if (ent->d_type == DT_DIR) {
-            simple_ftw_sig result = recurse_simple_ftw(path, new_len, depth + 1, cb, userdata);
+            simple_ftw_sig result = recurse_simple_ftw(path, new_len, depth + 1, cb, error_cb, userdata);
             if (result == S_FTW_STOP_ITERATION) {
                 closedir(dir);
                 return S_FTW_STOP_ITERATION;
@@ -81,9 +104,16 @@ static simple_ftw_sig recurse_simple_ftw(char* path, unsigned int path_len, int
 
 
 void simple_ftw(const char* path, simple_ftw_callback_t cb, void* userdata) {
+    simple_ftw_errors(path, cb, NULL, userdata);
+}
+
+void simple_ftw_errors(const char* path, simple_ftw_callback_t cb, simple_ftw_error_callback_t error_cb, void* userdata) {
     char buf[MAX_PATH_LEN];
     int path_len = strlen(path);
-    if (path_len >= MAX_PATH_LEN) return;
+    if (path_len >= MAX_PATH_LEN) {
+        if (error_cb) error_cb(path, ENAMETOOLONG, userdata);
+        return;
+    }
     memcpy(buf, path, path_len);
-    recurse_simple_ftw(buf, path_len, 1, cb, userdata);
+    recurse_simple_ftw(buf, path_len, 1, cb, error_cb, userdata);
 }
@@ -3,6 +3,9 @@
  * This implementation has hardcoded limits on the path length and max directory depth.
 */
 
+#ifndef DIR_WALKER_H
+#define DIR_WALKER_H
+
 #include <dirent.h>
 #include <stdlib.h>
 
@@ -27,7 +30,24 @@ typedef simple_ftw_sig (*simple_ftw_callback_t) (
     void* userdata                  // userdata that matches the userdata simple_ftw is called with
 );
 
+/*
+ * This is the type of the function that gets called when part of the tree can't be walked
+*/
+typedef void (*simple_ftw_error_callback_t) (
+    const char* path, // the directory that couldn't be read, or whose entries couldn't all be walked
+    int err,          // errno of the failure
+    void* userdata    // userdata that matches the userdata simple_ftw is called with
+);
+
 /*
  * Calls cb for every entry in path.
 */
 void simple_ftw(const char* path, simple_ftw_callback_t cb, void* userdata);
+
+/*
+ * The same as simple_ftw, but error_cb is called for every directory that couldn't be opened or read,
+ * or that holds an entry past MAX_PATH_LEN or MAX_DEPTH, as those entries are left out of the walk.
+*/
+void simple_ftw_errors(const char* path, simple_ftw_callback_t cb, simple_ftw_error_callback_t error_cb, void* userdata);
+
+#endif
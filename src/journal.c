@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "journal.h"
+
+// Size of the buffer records are collected in before being written
+#define JOURNAL_WRITE_SIZE 65536
+#define JOURNAL_MIN_SET_SIZE 16
+
+/// FNV-1a
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037UL;
+    while (*path != 0) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211UL;
+        path += 1;
+    }
+    return hash;
+}
+
+static void finished_set_insert(Journal* journal, char* dir) {
+    unsigned int mask = journal->finished_cap - 1;
+    unsigned int i = hash_path(dir) & mask;
+    while (journal->finished_set[i] != NULL) {
+        if (strcmp(journal->finished_set[i], dir) == 0) return;
+        i = (i + 1) & mask;
+    }
+    journal->finished_set[i] = dir;
+}
+
+/// Reads every record of the journal into the finished set.
+///
+/// Returns 0 on success, otherwise errno
+static int Journal_load(Journal* journal) {
+    struct stat st;
+    if (fstat(journal->fd, &st) == -1) return errno;
+
+    size_t size = st.st_size;
+    char* data = malloc(size + 1);
+    if (data == NULL) return ENOMEM;
+    journal->finished_data = data;
+
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(journal->fd, data + total, size - total);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return errno;
+        if (n == 0) break;
+        total += n;
+    }
+    // A record without a terminator was cut off mid-write, so it's ignored
+    while (total > 0 && data[total - 1] != 0) total -= 1;
+
+    unsigned int records = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (data[i] == 0) records += 1;
+    }
+    unsigned int cap = JOURNAL_MIN_SET_SIZE;
+    while (cap < records * 2) cap *= 2;
+    journal->finished_set = calloc(cap, sizeof(char*));
+    if (journal->finished_set == NULL) return ENOMEM;
+    journal->finished_cap = cap;
+
+    char* record = data;
+    while (record < data + total) {
+        size_t len = strlen(record);
+        if (len > 0) finished_set_insert(journal, record);
+        record += len + 1;
+    }
+    debug_printf("journal: loaded %u finished directories\n", records);
+    return 0;
+}
+
+int Journal_open(Journal* journal, const char* path, bool resume) {
+    memset(journal, 0, sizeof(*journal));
+    int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+    if (!resume) flags |= O_TRUNC;
+
+    journal->fd = open(path, flags, 0644);
+    if (journal->fd == -1) return errno;
+    journal->resuming = resume;
+
+    if (resume) {
+        int result = Journal_load(journal);
+        if (result != 0) {
+            Journal_close(journal);
+            return result;
+        }
+    }
+    return 0;
+}
+
+bool Journal_is_finished(const Journal* journal, const char* dir_relative) {
+    if (journal->finished_cap == 0) return false;
+    unsigned int mask = journal->finished_cap - 1;
+    unsigned int i = hash_path(dir_relative) & mask;
+    while (journal->finished_set[i] != NULL) {
+        if (strcmp(journal->finished_set[i], dir_relative) == 0) return true;
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+/// Moves the innermost directory of the walk to the pending list, now that its subtree ends at file_count
+static void Journal_pop_directory(Journal* journal, unsigned int file_count) {
+    journal->stack_depth -= 1;
+    unsigned int len = journal->stack_len[journal->stack_depth];
+    if (journal->stack_failed[journal->stack_depth]) return;
+
+    if (journal->pending_len == journal->pending_cap) {
+        unsigned int new_cap = journal->pending_cap == 0 ? 256 : journal->pending_cap * 2;
+        JournalRange* new_ranges = realloc(journal->pending_ranges, new_cap * sizeof(JournalRange));
+        // Directories that can't be recorded are simply walked again on resume
+        if (new_ranges == NULL) return;
+        journal->pending_ranges = new_ranges;
+        journal->pending_cap = new_cap;
+    }
+
+    char saved = journal->stack_path[len];
+    journal->stack_path[len] = 0;
+    StringList_add_nullterm(&journal->pending, journal->stack_path);
+    journal->stack_path[len] = saved;
+
+    journal->pending_ranges[journal->pending_len].start = journal->stack_start[journal->stack_depth];
+    journal->pending_ranges[journal->pending_len].end = file_count;
+    journal->pending_len += 1;
+}
+
+void Journal_walk_entry(Journal* journal, const char* relative, unsigned int file_count) {
+    while (journal->stack_depth > 0) {
+        unsigned int len = journal->stack_len[journal->stack_depth - 1];
+        bool is_ancestor = strncmp(journal->stack_path, relative, len) == 0 && relative[len] == '/';
+        if (is_ancestor) break;
+        Journal_pop_directory(journal, file_count);
+    }
+}
+
+void Journal_walk_directory(Journal* journal, const char* dir_relative, unsigned int dir_relative_len, unsigned int file_count) {
+    if (journal->stack_depth >= MAX_DEPTH || dir_relative_len >= MAX_PATH_LEN) return;
+    memcpy(journal->stack_path, dir_relative, dir_relative_len);
+    journal->stack_len[journal->stack_depth] = dir_relative_len;
+    journal->stack_start[journal->stack_depth] = file_count;
+    journal->stack_failed[journal->stack_depth] = false;
+    journal->stack_depth += 1;
+}
+
+void Journal_walk_failed(Journal* journal, const char* dir_relative, unsigned int file_count) {
+    while (journal->stack_depth > 0) {
+        unsigned int len = journal->stack_len[journal->stack_depth - 1];
+        bool is_self_or_ancestor = strncmp(journal->stack_path, dir_relative, len) == 0 &&
+            (dir_relative[len] == 0 || dir_relative[len] == '/');
+        if (is_self_or_ancestor) break;
+        Journal_pop_directory(journal, file_count);
+    }
+    // Every directory left on the stack contains the one that failed
+    for (int i = 0; i < journal->stack_depth; i++) journal->stack_failed[i] = true;
+}
+
+void Journal_walk_end(Journal* journal, unsigned int file_count) {
+    while (journal->stack_depth > 0) Journal_pop_directory(journal, file_count);
+    journal->pending_iter = StringList_iterate(&journal->pending);
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return errno;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/// Returns the position of the first failed index that is not less than index
+static unsigned int Journal_failed_lower_bound(const Journal* journal, unsigned int index) {
+    unsigned int lo = 0;
+    unsigned int hi = journal->failed_len;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (journal->failed[mid] < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void Journal_link_failed(Journal* journal, unsigned int index) {
+    if (journal->failed_len == journal->failed_cap) {
+        unsigned int new_cap = journal->failed_cap == 0 ? 64 : journal->failed_cap * 2;
+        unsigned int* new_failed = realloc(journal->failed, new_cap * sizeof(unsigned int));
+        if (new_failed == NULL) {
+            journal->failed_lost = true;
+            return;
+        }
+        journal->failed = new_failed;
+        journal->failed_cap = new_cap;
+    }
+    // Failures are rare, and arrive nearly in order, so insertion is cheap
+    unsigned int pos = Journal_failed_lower_bound(journal, index);
+    memmove(journal->failed + pos + 1, journal->failed + pos, (journal->failed_len - pos) * sizeof(unsigned int));
+    journal->failed[pos] = index;
+    journal->failed_len += 1;
+}
+
+/// Returns true if no link in range failed
+static bool Journal_range_succeeded(const Journal* journal, JournalRange range) {
+    unsigned int pos = Journal_failed_lower_bound(journal, range.start);
+    return pos == journal->failed_len || journal->failed[pos] >= range.end;
+}
+
+int Journal_checkpoint(Journal* journal, unsigned int completed) {
+    if (journal->failed_lost) return 0;
+    char buf[JOURNAL_WRITE_SIZE];
+    size_t len = 0;
+
+    while (journal->pending_checked < journal->pending_len && journal->pending_ranges[journal->pending_checked].end <= completed) {
+        char* dir = StringListIter_next(&journal->pending_iter);
+        JournalRange range = journal->pending_ranges[journal->pending_checked];
+        journal->pending_checked += 1;
+        if (!Journal_range_succeeded(journal, range)) continue;
+
+        size_t dir_len = strlen(dir);
+        if (len + dir_len + 1 > JOURNAL_WRITE_SIZE) {
+            int result = write_all(journal->fd, buf, len);
+            if (result != 0) return result;
+            len = 0;
+        }
+        // Includes the NUL terminator
+        memcpy(buf + len, dir, dir_len + 1);
+        len += dir_len + 1;
+    }
+
+    if (len == 0) return 0;
+    debug_printf("journal: checkpoint at %u, %u/%u directories\n", completed, journal->pending_checked, journal->pending_len);
+    return write_all(journal->fd, buf, len);
+}
+
+void Journal_close(Journal* journal) {
+    if (journal->fd != -1) close(journal->fd);
+    journal->fd = -1;
+    free(journal->finished_data);
+    free(journal->finished_set);
+    journal->finished_data = NULL;
+    journal->finished_set = NULL;
+    journal->finished_cap = 0;
+    StringList_free(&journal->pending);
+    free(journal->pending_ranges);
+    journal->pending_ranges = NULL;
+    journal->pending_len = 0;
+    journal->pending_cap = 0;
+    free(journal->failed);
+    journal->failed = NULL;
+    journal->failed_len = 0;
+    journal->failed_cap = 0;
+}
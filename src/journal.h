@@ -0,0 +1,142 @@
+/*
+ * A checkpoint journal, so an interrupted run can be resumed without starting over.
+ *
+ * The journal is a file of NUL-terminated directory paths, relative to the source directory.
+ * NUL is used rather than newlines, as it is the only byte that can't appear in a filename.
+ * A directory is only written once its whole subtree has been walked, and every file in it hardlinked successfully,
+ * so when resuming, the whole subtree can be skipped without walking it.
+ *
+ * Because the walk is depth-first, the files of each subtree are a contiguous range of the file list.
+ * The walk records where each range ends, and the linker reports how many files from the start
+ * of the list have completed; every directory whose range ends before that point,
+ * and doesn't contain a failed link, is finished.
+*/
+
+/** Example Usage
+Journal journal;
+if (Journal_open(&journal, "lndir.journal", resume) != 0) // ...
+
+// During the walk, for every entry, in walk order:
+Journal_walk_entry(&journal, relative_path, file_count);
+// and for every directory that will be descended into:
+Journal_walk_directory(&journal, relative_path, relative_path_len, file_count);
+// For every directory that can't be read, or holds entries that can't be walked:
+Journal_walk_failed(&journal, relative_path, file_count);
+// Once the walk is complete:
+Journal_walk_end(&journal, file_count);
+
+// For every link that fails, with its index in the file list:
+Journal_link_failed(&journal, index);
+// Whenever links complete, with the number completed from the start of the file list:
+Journal_checkpoint(&journal, completed);
+
+Journal_close(&journal);
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+
+#include "dir_walker.h"
+#include "string_list.h"
+
+/// The files of a directory's subtree are at [start, end) in the file list
+struct JournalRange {
+    unsigned int start;
+    unsigned int end;
+};
+typedef struct JournalRange JournalRange;
+
+struct Journal {
+    int fd;
+    bool resuming;
+
+    // Directories finished by a previous run; an open addressing hash set pointing into finished_data
+    char* finished_data;
+    char** finished_set;
+    unsigned int finished_cap;
+
+    // The directory currently being walked; each ancestor is a prefix of it
+    char stack_path[MAX_PATH_LEN];
+    unsigned int stack_len[MAX_DEPTH];
+    unsigned int stack_start[MAX_DEPTH];
+    bool stack_failed[MAX_DEPTH]; // part of the subtree couldn't be walked, so it is never finished
+    int stack_depth;
+
+    // Walked directories in the order they finish, and the range of each subtree in the file list
+    StringList pending;
+    StringListIter pending_iter;
+    JournalRange* pending_ranges;
+    unsigned int pending_len;
+    unsigned int pending_cap;
+    unsigned int pending_checked;
+
+    // Indices of failed links, sorted
+    unsigned int* failed;
+    unsigned int failed_len;
+    unsigned int failed_cap;
+    bool failed_lost; // a failure couldn't be recorded, so nothing more can be journaled
+};
+typedef struct Journal Journal;
+
+/*
+ * Opens the journal at path, creating it if it doesn't exist.
+ * If resume is true, the directories it already contains are loaded and new ones are appended,
+ * otherwise it is truncated.
+ *
+ * Returns 0 on success, otherwise errno
+*/
+int Journal_open(Journal* journal, const char* path, bool resume);
+
+/*
+ * Returns true if a previous run finished linking every file within dir_relative
+*/
+bool Journal_is_finished(const Journal* journal, const char* dir_relative);
+
+/*
+ * Called for each entry of the walk, before it is added to the file list.
+ * file_count is the number of files added to the file list so far.
+*/
+void Journal_walk_entry(Journal* journal, const char* relative, unsigned int file_count);
+
+/*
+ * Called for each directory the walk descends into, after Journal_walk_entry
+ * file_count is the number of files added to the file list so far.
+*/
+void Journal_walk_directory(Journal* journal, const char* dir_relative, unsigned int dir_relative_len, unsigned int file_count);
+
+/*
+ * Called when a directory of the walk couldn't be read, or some of its entries couldn't be walked.
+ * Files are missing from its subtree, so neither it nor any directory containing it is journaled.
+ * file_count is the number of files added to the file list so far.
+*/
+void Journal_walk_failed(Journal* journal, const char* dir_relative, unsigned int file_count);
+
+/*
+ * Called once the walk is complete, with the final length of the file list
+*/
+void Journal_walk_end(Journal* journal, unsigned int file_count);
+
+/*
+ * Records that the link at index in the file list failed,
+ * so no directory containing it is journaled as finished.
+*/
+void Journal_link_failed(Journal* journal, unsigned int index);
+
+/*
+ * Appends every directory whose files are all within the first `completed` files of the file list,
+ * unless one of its links failed.
+ * Records are buffered and written together, so this is cheap to call after every batch of completions.
+ * The write isn't synced; it survives the process being killed, but not the machine going down.
+ *
+ * Returns 0 on success, otherwise errno
+*/
+int Journal_checkpoint(Journal* journal, unsigned int completed);
+
+/*
+ * Closes the journal file and frees all memory
+*/
+void Journal_close(Journal* journal);
+
+#endif
@@ -7,9 +7,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <stdint.h>
 
 #include "lndir.h"
 #include "dir_walker.h"
+#include "journal.h"
 #include "debug.h"
 
 // Size of the Submission Queue
@@ -17,24 +19,64 @@
 // Number of submissions to queue before submitting
 // Must be smaller than MAX_SQE
 #define SQE_SUBMISSION_SIZE 64
+// Number of links that may be submitted past the oldest incomplete link
+#define LINK_WINDOW 4096
+
+/// Tracks which links have completed, so the number completed from the start of the file list is known
+/// even though io_uring completes them out of order.
+/// Each link is submitted with its index in the file list as the user data.
+struct LinkWindow {
+    char* paths[LINK_WINDOW];
+    bool done[LINK_WINDOW];
+    unsigned int submitted;
+    unsigned int completed; // every link before this index has completed
+    int src_dir_fd;
+    int dest_dir_fd;
+};
+typedef struct LinkWindow LinkWindow;
+
+/// Returns true if path in the destination is already a hardlink of path in the source
+static bool is_linked(int src_dir_fd, int dest_dir_fd, const char* path) {
+    struct stat src_st;
+    struct stat dest_st;
+    if (fstatat(src_dir_fd, path, &src_st, AT_SYMLINK_NOFOLLOW) == -1) return false;
+    if (fstatat(dest_dir_fd, path, &dest_st, AT_SYMLINK_NOFOLLOW) == -1) return false;
+    return src_st.st_dev == dest_st.st_dev && src_st.st_ino == dest_st.st_ino;
+}
 
 /// For each result in the completion queue, if it was an error, print to stderr
+/// If journal is not NULL, failed links are recorded, and a checkpoint is written once the results are drained.
+/// When resuming, a file that already exists counts as linked if it is the same file as the source.
 ///
 /// Returns the number of results handled
-int iouring_handle_results(struct io_uring* ring, lndir_callback_t cb, void* userdata) {
+int iouring_handle_results(struct io_uring* ring, LinkWindow* window, Journal* journal, lndir_callback_t cb, void* userdata) {
     debug_printf("iouring_handle_results:\n");
     struct io_uring_cqe* cqe;
     int count = 0;
     int result;
     while ((result = io_uring_peek_cqe(ring, &cqe)) == 0) {
 
-        char* path = io_uring_cqe_get_data(cqe);
+        unsigned int index = (uintptr_t)io_uring_cqe_get_data(cqe);
+        char* path = window->paths[index % LINK_WINDOW];
+        window->done[index % LINK_WINDOW] = true;
         int cb_result = -cqe->res;
+        if (cb_result == EEXIST && journal != NULL && journal->resuming &&
+            is_linked(window->src_dir_fd, window->dest_dir_fd, path)) {
+            cb_result = 0;
+        }
+        if (cb_result != 0 && journal != NULL) Journal_link_failed(journal, index);
         if (cb != NULL) cb(path, cb_result, userdata);
         count += 1;
 
         io_uring_cqe_seen(ring, cqe);
     }
+
+    while (window->completed < window->submitted && window->done[window->completed % LINK_WINDOW]) {
+        window->done[window->completed % LINK_WINDOW] = false;
+        window->completed += 1;
+    }
+    // A failed checkpoint only means more work on resume, so linking carries on regardless
+    if (journal != NULL && count > 0) Journal_checkpoint(journal, window->completed);
     return count;
 }
 
@@ -42,9 +84,12 @@ int iouring_handle_results(struct io_uring* ring, lndir_callback_t cb, void* use
 /// If any hardlink fails, the result is ignored from the return value of this function
 /// However, stderr is printed to.
 ///
+/// If journal is not NULL, finished directories are written to it as links complete
+///
 /// Returns 0 on success
 /// If io_uring fails, returns errno
-int hardlink_file_list_iouring_fd(StringListIter* file_list, int src_dir_fd, int dest_dir_fd, lndir_callback_t cb, void* userdata) {
+int hardlink_file_list_iouring_fd(
+    StringListIter* file_list, int src_dir_fd, int dest_dir_fd, Journal* journal, lndir_callback_t cb, void* userdata) {
     assert(src_dir_fd > 0);
     assert(dest_dir_fd > 0);
 
@@ -52,35 +97,48 @@ int hardlink_file_list_iouring_fd(StringListIter* file_list, int src_dir_fd, int
     int result = io_uring_queue_init(MAX_SQE, &ring, 0);
     if (result != 0) return -result;
 
-    int submission_count = 0;
-    int total_handled = 0;
+    LinkWindow window;
+    memset(window.done, 0, sizeof(window.done));
+    window.submitted = 0;
+    window.completed = 0;
+    window.src_dir_fd = src_dir_fd;
+    window.dest_dir_fd = dest_dir_fd;
+    unsigned int total_handled = 0;
 
     char* file_path;
     while ((file_path = StringListIter_next(file_list)) != NULL) {
+        // block until the oldest incomplete link is back within the window
+        while (window.submitted - window.completed >= LINK_WINDOW) {
+            io_uring_submit_and_wait(&ring, 1);
+            total_handled += iouring_handle_results(&ring, &window, journal, cb, userdata);
+        }
+
         struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
         // get_sqe returns NULL when the queue is full
         while (sqe == NULL) {
-            total_handled += iouring_handle_results(&ring, cb, userdata);
+            total_handled += iouring_handle_results(&ring, &window, journal, cb, userdata);
             sqe = io_uring_get_sqe(&ring);
         }
+        unsigned int index = window.submitted;
+        window.paths[index % LINK_WINDOW] = file_path;
         io_uring_prep_linkat(sqe, src_dir_fd, file_path, dest_dir_fd, file_path, 0);
-        io_uring_sqe_set_data(sqe, file_path);
-        submission_count += 1;
+        io_uring_sqe_set_data(sqe, (void*)(uintptr_t)index);
+        window.submitted += 1;
 
-        if (submission_count % SQE_SUBMISSION_SIZE == 0) {
+        if (window.submitted % SQE_SUBMISSION_SIZE == 0) {
             io_uring_submit(&ring);
         }
     }
 
     io_uring_submit(&ring);
 
-    while (total_handled < submission_count) {
-        debug_printf("handled/submitted:   %d/%d\n", total_handled, submission_count);
+    while (total_handled < window.submitted) {
+        debug_printf("handled/submitted:   %u/%u\n", total_handled, window.submitted);
         // block until ready
         struct io_uring_cqe* cqe;
         io_uring_wait_cqe(&ring, &cqe);
 
-        total_handled += iouring_handle_results(&ring, cb, userdata);
+        total_handled += iouring_handle_results(&ring, &window, journal, cb, userdata);
     }
     io_uring_queue_exit(&ring);
     return 0;
@@ -101,7 +159,7 @@ int hardlink_file_list_iouring(StringListIter* file_list, const char* src_dir, c
         close(src_fd);
         return 1;
     }
-    int result = hardlink_file_list_iouring_fd(file_list, src_fd, dest_fd, cb, userdata);
+    int result = hardlink_file_list_iouring_fd(file_list, src_fd, dest_fd, NULL, cb, userdata);
     close(src_fd);
     close(dest_fd);
     return result;
@@ -109,14 +167,19 @@ int hardlink_file_list_iouring(StringListIter* file_list, const char* src_dir, c
 
 struct WalkerContext {
     struct StringList file_list;
+    unsigned int file_count;
     int source_directory_len;
     int destination_directory_fd;
+    Journal* journal; // NULL unless journaling
+    lndir_callback_t cb;
+    void* userdata;
 };
 typedef struct WalkerContext WalkerContext;
 
 /// nftw callback
 /// For each directory in source, it creates a matching directory at the destination
 /// For each file in source, it adds the relative path to file_list
+/// Directories the journal has recorded as finished are skipped
 simple_ftw_sig copy_directories_add_filenames(const struct dirent* dir_entry, const char* path, unsigned int path_len, void* userdata) {
     WalkerContext* ctx = (WalkerContext*)userdata;
 
@@ -124,26 +187,54 @@ simple_ftw_sig copy_directories_add_filenames(const struct dirent* dir_entry, co
     assert(ctx->destination_directory_fd > 0);
     const char* file_relative = path + ctx->source_directory_len;
     while (file_relative[0] == '/') file_relative += 1;
+    if (ctx->journal != NULL) Journal_walk_entry(ctx->journal, file_relative, ctx->file_count);
 
     struct stat st;
     int result;
 
     switch (dir_entry->d_type) {
         case DT_DIR:
+            if (ctx->journal != NULL) {
+                if (Journal_is_finished(ctx->journal, file_relative)) return S_FTW_SKIP_DIRECTORY;
+                Journal_walk_directory(ctx->journal, file_relative, path_len - (file_relative - path), ctx->file_count);
+            }
             result = stat(path, &st);
             if (result == -1) break;
-            mkdirat(ctx->destination_directory_fd, file_relative, st.st_mode);
+            result = mkdirat(ctx->destination_directory_fd, file_relative, st.st_mode);
+            // The interrupted run may have created it while the source had a different mode, e.g. while unreadable
+            if (result == -1 && errno == EEXIST && ctx->journal != NULL && ctx->journal->resuming) {
+                fchmodat(ctx->destination_directory_fd, file_relative, st.st_mode & 07777, 0);
+            }
             break;
         case DT_REG:
             StringList_add_nullterm(&ctx->file_list, file_relative);
+            ctx->file_count += 1;
             break;
     }
            
     return S_FTW_CONTINUE;
 }
 
+/// simple_ftw error callback
+/// Reports the directory that couldn't be walked, and keeps it and its ancestors out of the journal,
+/// as files within them were never added to the file list
+static void report_walk_error(const char* path, int err, void* userdata) {
+    WalkerContext* ctx = (WalkerContext*)userdata;
+    const char* dir_relative = path + ctx->source_directory_len;
+    while (dir_relative[0] == '/') dir_relative += 1;
+    if (ctx->journal != NULL) Journal_walk_failed(ctx->journal, dir_relative, ctx->file_count);
+
+    char buf[MAX_PATH_LEN];
+    snprintf(buf, MAX_PATH_LEN, "%s", path);
+    if (ctx->cb != NULL) ctx->cb(buf, err, ctx->userdata);
+}
 
 enum lndir_result hardlink_directory_structure(const char* src_dir, const char* dest_dir, lndir_callback_t cb, void* userdata) {
+    return hardlink_directory_structure_journal(src_dir, dest_dir, NULL, false, cb, userdata);
+}
+
+enum lndir_result hardlink_directory_structure_journal(
+    const char* src_dir, const char* dest_dir, const char* journal_path, bool resume, lndir_callback_t cb, void* userdata) {
     int result = 0;
     int source_directory_fd = open(src_dir, O_DIRECTORY);
     if (source_directory_fd == -1) goto cleanup_1;
@@ -157,19 +248,32 @@ enum lndir_result hardlink_directory_structure(const char* src_dir, const char*
 
     WalkerContext ctx = {0};
     ctx.source_directory_len = strlen(src_dir);
+    ctx.cb = cb;
+    ctx.userdata = userdata;
     ctx.destination_directory_fd = open(dest_dir, O_DIRECTORY);
     if (ctx.destination_directory_fd == -1) goto cleanup_4;
 
-    simple_ftw(src_dir, &copy_directories_add_filenames, &ctx);
+    Journal journal;
+    if (journal_path != NULL) {
+        errno = Journal_open(&journal, journal_path, resume);
+        if (errno != 0) goto cleanup_5;
+        ctx.journal = &journal;
+    }
+
+    simple_ftw_errors(src_dir, &copy_directories_add_filenames, &report_walk_error, &ctx);
+    if (ctx.journal != NULL) Journal_walk_end(ctx.journal, ctx.file_count);
 
     StringListIter iter = StringList_iterate(&ctx.file_list);
-    errno = hardlink_file_list_iouring_fd(&iter, source_directory_fd, ctx.destination_directory_fd, cb, userdata);
-    if (errno != 0) goto cleanup_5; 
+    errno = hardlink_file_list_iouring_fd(&iter, source_directory_fd, ctx.destination_directory_fd, ctx.journal, cb, userdata);
+    if (errno != 0) goto cleanup_6; 
 
-    result = -5;
-cleanup_5:
+    result = -6;
+cleanup_6:
     result += 1;
     StringList_free(&ctx.file_list);
+    if (ctx.journal != NULL) Journal_close(ctx.journal);
+cleanup_5:
+    result += 1;
     close(ctx.destination_directory_fd);
 cleanup_4:
     result += 1;
@@ -2,6 +2,8 @@
 #ifndef LNDIR_H
 #define LNDIR_H
 
+#include <stdbool.h>
+
 #include "string_list.h"
 
 enum lndir_result {
@@ -10,7 +12,8 @@ enum lndir_result {
     LNDIR_SRC_STAT = 2,
     LNDIR_DEST_CREATE = 3,
     LNDIR_DEST_OPEN = 4,
-    LNDIR_IO_URING = 5,
+    LNDIR_JOURNAL_OPEN = 5,
+    LNDIR_IO_URING = 6,
 };
 
 typedef int (*lndir_callback_t)(char* path, int result, void* userdata);
@@ -30,11 +33,24 @@ typedef int (*lndir_callback_t)(char* path, int result, void* userdata);
  *   2 if source directory couldn't be stat-ed
  *   3 if destination directory couldn't be created
  *   4 if destination directory couldn't be opened
- *   5 if io_uring fails
+ *   5 if the journal couldn't be opened
+ *   6 if io_uring fails
  *
  *   For any non-zero return, errno is set to the reason for the failure
  */
 enum lndir_result hardlink_directory_structure(
     const char* src_dir, const char* dest_dir, lndir_callback_t cb, void* userdata);
 
+/*
+ * The same as hardlink_directory_structure, but if journal_path is not NULL,
+ * every directory whose files have all been linked is recorded in the journal at journal_path.
+ *
+ * If resume is true, the existing journal is kept, and directories it records are skipped entirely.
+ * A directory isn't finished if any link within it failed.
+ * Files in directories that weren't finished are linked again;
+ * those the interrupted run already linked are reported as successes, rather than EEXIST.
+ */
+enum lndir_result hardlink_directory_structure_journal(
+    const char* src_dir, const char* dest_dir, const char* journal_path, bool resume, lndir_callback_t cb, void* userdata);
+
 #endif
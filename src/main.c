@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #include "lndir.h"
+#include "watch.h"
 #include "debug.h"
 
 #ifndef VERSION
@@ -23,13 +25,28 @@ void print_help(const char* prog_name) {
         "within <target_directory>.\n"
         "\n"
         "Options:\n"
-        "  -h, --help        Print this help message\n"
-        "  -v, --version     Print the version\n"
+        "  --                  Treat every following argument as a directory\n"
+        "  -h, --help          Print this help message\n"
+        "  -v, --version       Print the version\n"
+        "  -j, --journal FILE  Record finished directories in FILE, so an interrupted run can be resumed\n"
+        "      --resume        Skip the directories recorded in the journal, and continue from there.\n"
+        "                      Files the interrupted run already linked are counted as linked.\n"
+        "                      Requires --journal\n"
+        "  -w, --watch         After linking, keep watching <source_directory>, and apply every\n"
+        "                      created, renamed, and deleted file to <target_directory>\n"
         "\n"
         "Example:\n"
         "  %s /path/to/source /path/to/target\n"
-        "  %s relative/source relative/target\n";
-    printf(help_string, prog_name, prog_name, prog_name);
+        "  %s relative/source relative/target\n"
+        "  %s --journal big.journal --resume /path/to/big /path/to/target\n"
+        "  %s --watch dotfiles/ ~/\n";
+    printf(help_string, prog_name, prog_name, prog_name, prog_name, prog_name);
+}
+
+void print_usage_error(const char* prog_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS] <source_directory> <target_directory>\n", prog_name);
+    fprintf(stderr, "Try '%s --help' for more information\n", prog_name);
+    exit(EXIT_FAILURE);
 }
 
 struct LinkResults {
@@ -49,25 +66,63 @@ int lndir_cb(char* path, int result, void* userdata) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
-        print_help(argv[0]);
-        exit(EXIT_SUCCESS);
-    }
-    if (argc == 2 && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--version") == 0)) {
-        print_version();
-        exit(EXIT_SUCCESS);
+    char* input = NULL;
+    char* output = NULL;
+    char* journal_path = NULL;
+    bool resume = false;
+    bool watch_mode = false;
+    bool options_done = false;
+
+    for (int i = 1; i < argc; i++) {
+        char* arg = argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == 0) {
+            if (input == NULL) {
+                input = arg;
+            } else if (output == NULL) {
+                output = arg;
+            } else {
+                print_usage_error(argv[0]);
+            }
+        } else if (strcmp(arg, "--") == 0) {
+            options_done = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--version") == 0) {
+            print_version();
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--journal") == 0) {
+            if (i + 1 >= argc) print_usage_error(argv[0]);
+            i += 1;
+            journal_path = argv[i];
+        } else if (strcmp(arg, "--resume") == 0) {
+            resume = true;
+        } else if (strcmp(arg, "-w") == 0 || strcmp(arg, "--watch") == 0) {
+            watch_mode = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage_error(argv[0]);
+        }
     }
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source_directory> <target_directory>\n", argv[0]);
-        fprintf(stderr, "Try '%s --help' for more information\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (output == NULL) print_usage_error(argv[0]);
+    if (resume && journal_path == NULL) {
+        fprintf(stderr, "--resume requires --journal\n");
+        print_usage_error(argv[0]);
     }
 
-    char* input = argv[1];
-    char* output = argv[2];
-
     LinkResults results = {0};
-    enum lndir_result result = hardlink_directory_structure(input, output, lndir_cb, &results);
+
+    // Watches are added before linking, so changes made during the first run aren't missed
+    Watch watch;
+    if (watch_mode) {
+        errno = Watch_open(&watch, input, output, lndir_cb, &results);
+        if (errno != 0) {
+            printf("Source directory (%s) couldn't be watched:  %s \n", input, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    enum lndir_result result = hardlink_directory_structure_journal(input, output, journal_path, resume, lndir_cb, &results);
     printf("Total linked files:  %d / %d\n", results.successes, results.total_handled);
 
     switch (result) {
@@ -86,6 +141,9 @@ int main(int argc, char* argv[]) {
     case (LNDIR_DEST_OPEN):
         printf("Destination directory couldn't be opened:  %s \n", strerror(errno));
         break;
+    case (LNDIR_JOURNAL_OPEN):
+        printf("Journal (%s) couldn't be opened:  %s \n", journal_path, strerror(errno));
+        break;
     case (LNDIR_IO_URING):
         printf("io_uring couldn't be initialised:  %s \n", strerror(errno));
         break;
@@ -93,5 +151,13 @@ int main(int argc, char* argv[]) {
         debug_printf("Unexpected result (%d), errno %d: %s\n", result, errno, strerror(errno));
         break;
     }
+
+    if (watch_mode && result == LNDIR_SUCCESS) {
+        printf("Watching for changes in %s\n", input);
+        fflush(stdout);
+        errno = Watch_run(&watch);
+        printf("Watching stopped:  %s \n", strerror(errno));
+    }
+    if (watch_mode) Watch_close(&watch);
     
 }
@@ -3,11 +3,17 @@ const Io = std.Io;
 const testing = std.testing;
 const sl = @import("string_list");
 const lndir = @import("lndir");
+const jn = @import("journal");
+const wt = @import("watch");
 
 extern fn append_path(source_path: [*c]u8, source_path_len: c_uint, path_to_append: [*c]const u8) c_uint;
 
 extern fn hardlink_file_list_iouring(file_list: *sl.StringListIter, src_dir: [*:0]const u8, dest_dir: [*:0]const u8, cb: lndir.lndir_callback_t, userdata: ?*anyopaque) c_int;
 
+extern fn rename(old_path: [*:0]const u8, new_path: [*:0]const u8) c_int;
+extern fn chmod(path: [*:0]const u8, mode: c_uint) c_int;
+extern fn geteuid() c_uint;
+
 test "append path" {
     var buf: [4096]u8 = undefined;
     try test_append_path(&buf, "start", "stuff", "start/stuff");
@@ -93,3 +99,329 @@ test "StringList consistency" {
         try testing.expectEqualStrings(b, a);
     }
 }
+
+test "Journal checkpoint and resume" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    const journal_path = "test.journal";
+    defer std.Io.Dir.deleteFile(cwd, io, journal_path) catch {};
+
+    var journal: jn.Journal = undefined;
+    try testing.expectEqual(0, jn.Journal_open(&journal, journal_path, false));
+
+    // Walk of: a/ a/x a/b/ a/b/y c/ c/z
+    jn.Journal_walk_entry(&journal, "a", 0);
+    jn.Journal_walk_directory(&journal, "a", 1, 0);
+    jn.Journal_walk_entry(&journal, "a/x", 0);
+    jn.Journal_walk_entry(&journal, "a/b", 1);
+    jn.Journal_walk_directory(&journal, "a/b", 3, 1);
+    jn.Journal_walk_entry(&journal, "a/b/y", 1);
+    jn.Journal_walk_entry(&journal, "c", 2);
+    jn.Journal_walk_directory(&journal, "c", 1, 2);
+    jn.Journal_walk_entry(&journal, "c/z", 2);
+    jn.Journal_walk_end(&journal, 3);
+
+    // Only the first two files have been linked, so c isn't finished
+    try testing.expectEqual(0, jn.Journal_checkpoint(&journal, 2));
+    jn.Journal_close(&journal);
+
+    try testing.expectEqual(0, jn.Journal_open(&journal, journal_path, true));
+    defer jn.Journal_close(&journal);
+    try testing.expect(jn.Journal_is_finished(&journal, "a"));
+    try testing.expect(jn.Journal_is_finished(&journal, "a/b"));
+    try testing.expect(!jn.Journal_is_finished(&journal, "c"));
+}
+
+const LinkCounts = struct {
+    successes: c_int = 0,
+    failures: c_int = 0,
+};
+
+fn count_links(path: [*c]u8, result: c_int, userdata: ?*anyopaque) callconv(.c) c_int {
+    _ = path;
+    const counts: *LinkCounts = @ptrCast(@alignCast(userdata));
+    if (result == 0) counts.successes += 1 else counts.failures += 1;
+    return 0;
+}
+
+fn create_file(io: Io, filename: []const u8) !void {
+    const cwd = std.Io.Dir.cwd();
+    const file = try std.Io.Dir.createFile(cwd, io, filename, .{});
+    file.close(io);
+}
+
+fn expect_file_missing(io: Io, filename: [:0]const u8) !void {
+    const cwd = std.Io.Dir.cwd();
+    if (std.Io.Dir.openFile(cwd, io, filename, .{ .mode = .read_only })) |f| {
+        f.close(io);
+        return error.TestUnexpectedResult;
+    } else |_| {}
+}
+
+test "lndir journal and resume" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    const source_dir = "journal_src";
+    const destination_dir = "journal_dst";
+    const journal_path = "journal_test.journal";
+
+    defer std.Io.Dir.deleteTree(cwd, io, source_dir) catch {};
+    defer std.Io.Dir.deleteTree(cwd, io, destination_dir) catch {};
+    defer std.Io.Dir.deleteFile(cwd, io, journal_path) catch {};
+
+    try std.Io.Dir.deleteTree(cwd, io, source_dir);
+    try std.Io.Dir.deleteTree(cwd, io, destination_dir);
+    inline for (.{ "", "/big", "/a", "/a/b", "/c" }) |d| {
+        try std.Io.Dir.createDir(cwd, io, source_dir ++ d, .default_dir);
+    }
+    // More files than the link window, so completions are tracked across it wrapping around
+    var name_buf: [64]u8 = undefined;
+    for (0..5000) |i| {
+        try create_file(io, try std.fmt.bufPrint(&name_buf, source_dir ++ "/big/f{d}", .{i}));
+    }
+    inline for (.{ "/a/x", "/a/b/y", "/c/z", "/top" }) |f| try create_file(io, source_dir ++ f);
+
+    // An unrelated file in the destination makes the link of c/z fail
+    try std.Io.Dir.createDir(cwd, io, destination_dir, .default_dir);
+    try std.Io.Dir.createDir(cwd, io, destination_dir ++ "/c", .default_dir);
+    try create_file(io, destination_dir ++ "/c/z");
+
+    var counts: LinkCounts = .{};
+    var result = lndir.hardlink_directory_structure_journal(source_dir, destination_dir, journal_path, false, &count_links, &counts);
+    try testing.expect(result == lndir.LNDIR_SUCCESS);
+    try testing.expectEqual(5003, counts.successes);
+    try testing.expectEqual(1, counts.failures);
+
+    var journal: jn.Journal = undefined;
+    try testing.expectEqual(0, jn.Journal_open(&journal, journal_path, true));
+    try testing.expect(jn.Journal_is_finished(&journal, "big"));
+    try testing.expect(jn.Journal_is_finished(&journal, "a"));
+    try testing.expect(jn.Journal_is_finished(&journal, "a/b"));
+    try testing.expect(!jn.Journal_is_finished(&journal, "c"));
+    jn.Journal_close(&journal);
+
+    // Finished subtrees are skipped, so a missing link within one isn't noticed
+    try std.Io.Dir.deleteFile(cwd, io, destination_dir ++ "/a/b/y");
+    try std.Io.Dir.deleteFile(cwd, io, destination_dir ++ "/c/z");
+
+    // Only top and c/z are linked again; top was already linked, so it counts as a success
+    counts = .{};
+    result = lndir.hardlink_directory_structure_journal(source_dir, destination_dir, journal_path, true, &count_links, &counts);
+    try testing.expect(result == lndir.LNDIR_SUCCESS);
+    try testing.expectEqual(2, counts.successes);
+    try testing.expectEqual(0, counts.failures);
+    try expect_file_exists(io, destination_dir ++ "/c/z");
+    try expect_file_missing(io, destination_dir ++ "/a/b/y");
+}
+
+test "lndir journal skips unreadable directories" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    const source_dir = "journal_unreadable_src";
+    const destination_dir = "journal_unreadable_dst";
+    const journal_path = "journal_unreadable.journal";
+
+    defer std.Io.Dir.deleteTree(cwd, io, source_dir) catch {};
+    defer std.Io.Dir.deleteTree(cwd, io, destination_dir) catch {};
+    defer std.Io.Dir.deleteFile(cwd, io, journal_path) catch {};
+    defer _ = chmod(source_dir ++ "/locked", 0o755);
+
+    try std.Io.Dir.deleteTree(cwd, io, source_dir);
+    try std.Io.Dir.deleteTree(cwd, io, destination_dir);
+    inline for (.{ "", "/open", "/locked", "/deep" }) |d| {
+        try std.Io.Dir.createDir(cwd, io, source_dir ++ d, .default_dir);
+    }
+    inline for (.{ "/open/x", "/locked/secret" }) |f| try create_file(io, source_dir ++ f);
+
+    // Directories past MAX_DEPTH aren't walked, which doesn't depend on permissions
+    const deep = source_dir ++ "/deep" ++ ("/d" ** 255);
+    var depth: usize = (source_dir ++ "/deep").len;
+    while (depth < deep.len) : (depth += 2) {
+        try std.Io.Dir.createDir(cwd, io, deep[0 .. depth + 2], .default_dir);
+    }
+    try create_file(io, deep ++ "/f");
+
+    // root can read any directory, so the mode only makes locked unreadable for other users
+    const can_lock = geteuid() != 0;
+    if (can_lock) try testing.expectEqual(0, chmod(source_dir ++ "/locked", 0));
+
+    var counts: LinkCounts = .{};
+    var result = lndir.hardlink_directory_structure_journal(source_dir, destination_dir, journal_path, false, &count_links, &counts);
+    try testing.expect(result == lndir.LNDIR_SUCCESS);
+    // The directories that couldn't be walked are reported as failures
+    try testing.expectEqual(if (can_lock) 2 else 1, counts.failures);
+
+    var journal: jn.Journal = undefined;
+    try testing.expectEqual(0, jn.Journal_open(&journal, journal_path, true));
+    try testing.expect(jn.Journal_is_finished(&journal, "open"));
+    if (can_lock) try testing.expect(!jn.Journal_is_finished(&journal, "locked"));
+    try testing.expect(!jn.Journal_is_finished(&journal, "deep"));
+    try testing.expect(!jn.Journal_is_finished(&journal, "deep/d"));
+    jn.Journal_close(&journal);
+
+    // Once it can be read, resuming links what was missed
+    try testing.expectEqual(0, chmod(source_dir ++ "/locked", 0o755));
+    counts = .{};
+    result = lndir.hardlink_directory_structure_journal(source_dir, destination_dir, journal_path, true, &count_links, &counts);
+    try testing.expect(result == lndir.LNDIR_SUCCESS);
+    try expect_file_exists(io, destination_dir ++ "/locked/secret");
+}
+
+const watch_source_dir = "watch_src";
+const watch_destination_dir = "watch_dst";
+
+/// Creates a source tree containing a/x, mirrors it, and watches it
+fn start_watch(io: Io, watch: *wt.Watch, counts: *LinkCounts) !void {
+    const cwd = std.Io.Dir.cwd();
+    try std.Io.Dir.deleteTree(cwd, io, watch_source_dir);
+    try std.Io.Dir.deleteTree(cwd, io, watch_destination_dir);
+    try std.Io.Dir.createDir(cwd, io, watch_source_dir, .default_dir);
+    try std.Io.Dir.createDir(cwd, io, watch_source_dir ++ "/a", .default_dir);
+    try create_file(io, watch_source_dir ++ "/a/x");
+
+    try testing.expectEqual(0, wt.Watch_open(watch, watch_source_dir, watch_destination_dir, &count_links, counts));
+    const result = lndir.hardlink_directory_structure(watch_source_dir, watch_destination_dir, &count_links, counts);
+    try testing.expect(result == lndir.LNDIR_SUCCESS);
+    try expect_file_exists(io, watch_destination_dir ++ "/a/x");
+}
+
+fn stop_watch(io: Io, watch: *wt.Watch) void {
+    const cwd = std.Io.Dir.cwd();
+    wt.Watch_close(watch);
+    std.Io.Dir.deleteTree(cwd, io, watch_source_dir) catch {};
+    std.Io.Dir.deleteTree(cwd, io, watch_destination_dir) catch {};
+}
+
+test "watch create and delete" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    var counts: LinkCounts = .{};
+    var watch: wt.Watch = undefined;
+    try start_watch(io, &watch, &counts);
+    defer stop_watch(io, &watch);
+
+    try create_file(io, watch_source_dir ++ "/new");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/new");
+
+    try std.Io.Dir.deleteFile(cwd, io, watch_source_dir ++ "/new");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_missing(io, watch_destination_dir ++ "/new");
+
+    // A new directory is mirrored along with everything already in it
+    try std.Io.Dir.createDir(cwd, io, watch_source_dir ++ "/d", .default_dir);
+    try std.Io.Dir.createDir(cwd, io, watch_source_dir ++ "/d/e", .default_dir);
+    try create_file(io, watch_source_dir ++ "/d/e/f");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/d/e/f");
+
+    try std.Io.Dir.deleteTree(cwd, io, watch_source_dir ++ "/d");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_missing(io, watch_destination_dir ++ "/d/e/f");
+    try expect_file_missing(io, watch_destination_dir ++ "/d");
+    try testing.expectEqual(0, counts.failures);
+}
+
+test "watch file and directory rename" {
+    const io = testing.io;
+    var counts: LinkCounts = .{};
+    var watch: wt.Watch = undefined;
+    try start_watch(io, &watch, &counts);
+    defer stop_watch(io, &watch);
+
+    try testing.expectEqual(0, rename(watch_source_dir ++ "/a/x", watch_source_dir ++ "/a/y"));
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/a/y");
+    try expect_file_missing(io, watch_destination_dir ++ "/a/x");
+
+    try testing.expectEqual(0, rename(watch_source_dir ++ "/a", watch_source_dir ++ "/b"));
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/b/y");
+    try expect_file_missing(io, watch_destination_dir ++ "/a");
+
+    // Events within the renamed directory use its new path
+    try create_file(io, watch_source_dir ++ "/b/z");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/b/z");
+
+    // A change recorded before a rename in the same batch follows the directory
+    try create_file(io, watch_source_dir ++ "/b/w");
+    try testing.expectEqual(0, rename(watch_source_dir ++ "/b", watch_source_dir ++ "/c"));
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/c/w");
+    try expect_file_exists(io, watch_destination_dir ++ "/c/z");
+    try expect_file_missing(io, watch_destination_dir ++ "/b");
+    try testing.expectEqual(0, counts.failures);
+}
+
+test "watch leaves unrelated destination files alone" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    var counts: LinkCounts = .{};
+    var watch: wt.Watch = undefined;
+    try start_watch(io, &watch, &counts);
+    defer stop_watch(io, &watch);
+
+    // A file that didn't come from the source is reported, not replaced
+    try create_file(io, watch_destination_dir ++ "/user");
+    try create_file(io, watch_source_dir ++ "/user");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try testing.expectEqual(1, counts.failures);
+
+    try std.Io.Dir.deleteFile(cwd, io, watch_source_dir ++ "/user");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/user");
+
+    // Removing a source directory only removes what was mirrored into it
+    try create_file(io, watch_destination_dir ++ "/a/mine");
+    try std.Io.Dir.deleteTree(cwd, io, watch_source_dir ++ "/a");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_missing(io, watch_destination_dir ++ "/a/x");
+    try expect_file_exists(io, watch_destination_dir ++ "/a/mine");
+}
+
+test "watch leaves files alone that reuse a freed inode" {
+    const io = testing.io;
+    const cwd = std.Io.Dir.cwd();
+    var counts: LinkCounts = .{};
+    var watch: wt.Watch = undefined;
+    try start_watch(io, &watch, &counts);
+    defer stop_watch(io, &watch);
+
+    // Filesystems like ext4 hand a freed inode to the next file created,
+    // so the user's file gets the inode of the source file the mirror had linked
+    var name_buf: [64]u8 = undefined;
+    for (0..8) |i| {
+        const victim = try std.fmt.bufPrintZ(&name_buf, watch_source_dir ++ "/victim{d}", .{i});
+        try create_file(io, victim);
+        try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+        try std.Io.Dir.deleteFile(cwd, io, victim);
+        try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+
+        try create_file(io, try std.fmt.bufPrint(&name_buf, watch_destination_dir ++ "/notes{d}", .{i}));
+        counts = .{};
+        try create_file(io, try std.fmt.bufPrint(&name_buf, watch_source_dir ++ "/notes{d}", .{i}));
+        try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+        try testing.expectEqual(1, counts.failures);
+
+        try std.Io.Dir.deleteFile(cwd, io, try std.fmt.bufPrint(&name_buf, watch_source_dir ++ "/notes{d}", .{i}));
+        try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+        try expect_file_exists(io, try std.fmt.bufPrintZ(&name_buf, watch_destination_dir ++ "/notes{d}", .{i}));
+    }
+}
+
+test "watch overflow" {
+    const io = testing.io;
+    var counts: LinkCounts = .{};
+    var watch: wt.Watch = undefined;
+    try start_watch(io, &watch, &counts);
+    defer stop_watch(io, &watch);
+
+    // After events are lost, the whole tree is mirrored again
+    watch.overflowed = true;
+    try create_file(io, watch_source_dir ++ "/o");
+    try testing.expectEqual(0, wt.Watch_step(&watch, 1000));
+    try expect_file_exists(io, watch_destination_dir ++ "/o");
+    try expect_file_exists(io, watch_destination_dir ++ "/a/x");
+    try testing.expectEqual(0, counts.failures);
+}
@@ -0,0 +1,707 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "watch.h"
+
+// Size of the Submission Queue
+#define MAX_SQE 128
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+// How long to wait for further events before applying a batch
+#define WATCH_COALESCE_MS 50
+// Apply a batch once this many paths have changed, even if events are still arriving
+#define WATCH_MAX_BATCH 4096
+#define WATCH_EVENT_BUF_SIZE 65536
+#define WATCH_MIN_LINKED 1024
+// The source directory itself, as a changed path; a StringList can't hold an empty string
+#define WATCH_ROOT "."
+
+/// Returns true if path is dir, or is within dir
+static bool is_within(const char* dir, const char* path) {
+    size_t len = strlen(dir);
+    if (len == 0) return true;
+    return strncmp(dir, path, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+/// Writes dir/relative to buf. relative may be empty.
+///
+/// Returns false if the path doesn't fit in MAX_PATH_LEN
+static bool join_path(char* buf, const char* dir, const char* relative) {
+    const char* sep = (dir[0] != 0 && relative[0] != 0) ? "/" : "";
+    int len = snprintf(buf, MAX_PATH_LEN, "%s%s%s", dir, sep, relative);
+    return len >= 0 && len < MAX_PATH_LEN;
+}
+
+static void Watch_set_path(Watch* watch, int wd, const char* relative) {
+    if (wd >= watch->wd_cap) {
+        int new_cap = watch->wd_cap == 0 ? 256 : watch->wd_cap;
+        while (new_cap <= wd) new_cap *= 2;
+        char** new_paths = realloc(watch->wd_paths, new_cap * sizeof(char*));
+        if (new_paths == NULL) return;
+        memset(new_paths + watch->wd_cap, 0, (new_cap - watch->wd_cap) * sizeof(char*));
+        watch->wd_paths = new_paths;
+        watch->wd_cap = new_cap;
+    }
+    free(watch->wd_paths[wd]);
+    watch->wd_paths[wd] = strdup(relative);
+}
+
+/// FNV-1a
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037UL;
+    while (*path != 0) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211UL;
+        path += 1;
+    }
+    return hash;
+}
+
+/// Returns the slot of the path in the map, or the empty slot it would go in
+static WatchLink* Watch_find_link(const Watch* watch, uint64_t path_hash) {
+    unsigned int mask = watch->linked_cap - 1;
+    unsigned int i = path_hash & mask;
+    while (watch->linked[i].ino != 0 && watch->linked[i].path_hash != path_hash) i = (i + 1) & mask;
+    return &watch->linked[i];
+}
+
+/// Records that the source inode ino is linked at relative in the destination, or is about to be
+static void Watch_set_linked(Watch* watch, const char* relative, ino_t ino) {
+    if (ino == 0) return;
+    if ((watch->linked_len + 1) * 2 > watch->linked_cap) {
+        unsigned int new_cap = watch->linked_cap == 0 ? WATCH_MIN_LINKED : watch->linked_cap * 2;
+        WatchLink* new_linked = calloc(new_cap, sizeof(WatchLink));
+        // Paths that can't be recorded are treated as not being from the mirror, so are left alone
+        if (new_linked == NULL) return;
+
+        WatchLink* old_linked = watch->linked;
+        unsigned int old_cap = watch->linked_cap;
+        watch->linked = new_linked;
+        watch->linked_cap = new_cap;
+        for (unsigned int i = 0; i < old_cap; i++) {
+            if (old_linked[i].ino != 0) *Watch_find_link(watch, old_linked[i].path_hash) = old_linked[i];
+        }
+        free(old_linked);
+    }
+
+    uint64_t path_hash = hash_path(relative);
+    WatchLink* slot = Watch_find_link(watch, path_hash);
+    if (slot->ino == 0) watch->linked_len += 1;
+    slot->path_hash = path_hash;
+    slot->ino = ino;
+}
+
+/// Forgets relative, once the mirror's file there is unlinked, moved, or no longer in the source
+static void Watch_clear_linked(Watch* watch, const char* relative) {
+    if (watch->linked_cap == 0) return;
+    WatchLink* slot = Watch_find_link(watch, hash_path(relative));
+    if (slot->ino == 0) return;
+    slot->ino = 0;
+    watch->linked_len -= 1;
+
+    // Linear probing: move back every following entry that can no longer be reached past the hole
+    unsigned int mask = watch->linked_cap - 1;
+    unsigned int hole = slot - watch->linked;
+    unsigned int i = (hole + 1) & mask;
+    while (watch->linked[i].ino != 0) {
+        unsigned int home = watch->linked[i].path_hash & mask;
+        bool reachable = hole < i ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!reachable) {
+            watch->linked[hole] = watch->linked[i];
+            watch->linked[i].ino = 0;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+/// Returns true if relative in the destination is still the file the mirror linked there.
+/// An inode freed since then may have been reused by another file, so only the path it was linked at counts.
+static bool Watch_is_mirrored(const Watch* watch, const char* relative, const struct stat* st) {
+    if (watch->linked_cap == 0 || S_ISDIR(st->st_mode) || st->st_dev != watch->src_dev) return false;
+    WatchLink* slot = Watch_find_link(watch, hash_path(relative));
+    return slot->ino != 0 && slot->ino == st->st_ino;
+}
+
+static void Watch_add(Watch* watch, const char* path, const char* relative) {
+    int wd = inotify_add_watch(watch->inotify_fd, path, WATCH_MASK);
+    if (wd == -1) {
+        // Directories removed since they were seen are expected
+        if (errno != ENOENT && watch->add_error == 0) watch->add_error = errno;
+        return;
+    }
+    Watch_set_path(watch, wd, relative);
+}
+
+/// simple_ftw callback
+/// Adds a watch to every directory, and records every file as linked at the same path,
+/// as that is where the initial run links it
+static simple_ftw_sig watch_directory(const struct dirent* dir_entry, const char* path, unsigned int path_len, void* userdata) {
+    Watch* watch = userdata;
+    const char* relative = path + watch->src_dir_len;
+    while (relative[0] == '/') relative += 1;
+
+    if (dir_entry->d_type == DT_REG) Watch_set_linked(watch, relative, dir_entry->d_ino);
+    if (dir_entry->d_type == DT_DIR) Watch_add(watch, path, relative);
+    return S_FTW_CONTINUE;
+}
+
+/// Watches the directory at relative, and every directory within it, and records every file within it as linked.
+/// Directories that are already watched keep their watch descriptor, and just have their path updated.
+static void Watch_watch_tree(Watch* watch, const char* relative) {
+    char path[MAX_PATH_LEN];
+    if (!join_path(path, watch->src_dir, relative)) return;
+    Watch_add(watch, path, relative);
+    simple_ftw(path, &watch_directory, watch);
+}
+
+static void Watch_mark_dirty(Watch* watch, const char* relative) {
+    StringList_add_nullterm(&watch->dirty, relative);
+    watch->dirty_count += 1;
+}
+
+/// The directory at relative has left the source.
+/// Every directory within it is marked as changed, so what was mirrored into each is removed,
+/// and its watch is removed.
+static void Watch_forget_tree(Watch* watch, const char* relative) {
+    for (int wd = 0; wd < watch->wd_cap; wd++) {
+        char* path = watch->wd_paths[wd];
+        if (path == NULL || !is_within(relative, path)) continue;
+        Watch_mark_dirty(watch, path);
+        inotify_rm_watch(watch->inotify_fd, wd);
+        free(path);
+        watch->wd_paths[wd] = NULL;
+    }
+    Watch_mark_dirty(watch, relative);
+}
+
+/// Rewrites every path within from to be within to instead
+static char* replace_prefix(const char* path, const char* from, const char* to) {
+    char buf[MAX_PATH_LEN];
+    const char* rest = path + strlen(from);
+    while (rest[0] == '/') rest += 1;
+    if (!join_path(buf, to, rest)) return NULL;
+    return strdup(buf);
+}
+
+struct MirroredTree {
+    Watch* watch;
+    bool mirrored;
+};
+typedef struct MirroredTree MirroredTree;
+
+/// Returns the path of the destination file at path relative to dest_dir
+static const char* dest_relative(const Watch* watch, const char* path) {
+    const char* relative = path + strlen(watch->dest_dir);
+    while (relative[0] == '/') relative += 1;
+    return relative;
+}
+
+/// simple_ftw callback
+/// Stops at the first file that wasn't linked from the source
+static simple_ftw_sig check_mirrored(const struct dirent* dir_entry, const char* path, unsigned int path_len, void* userdata) {
+    MirroredTree* tree = userdata;
+    if (dir_entry->d_type == DT_DIR) return S_FTW_CONTINUE;
+
+    struct stat st;
+    if (lstat(path, &st) == -1 || !Watch_is_mirrored(tree->watch, dest_relative(tree->watch, path), &st)) {
+        tree->mirrored = false;
+        return S_FTW_STOP_ITERATION;
+    }
+    return S_FTW_CONTINUE;
+}
+
+/// Returns true if every file within the destination directory at relative was linked from the source
+static bool Watch_is_mirrored_tree(Watch* watch, const char* relative) {
+    char path[MAX_PATH_LEN];
+    if (!join_path(path, watch->dest_dir, relative)) return false;
+    MirroredTree tree = {.watch = watch, .mirrored = true};
+    simple_ftw(path, &check_mirrored, &tree);
+    return tree.mirrored;
+}
+
+struct MovedTree {
+    Watch* watch;
+    const char* from;
+    const char* to;
+};
+typedef struct MovedTree MovedTree;
+
+/// simple_ftw callback
+/// Moves the record of each file in a renamed destination directory from its old path to its new one
+static simple_ftw_sig move_linked(const struct dirent* dir_entry, const char* path, unsigned int path_len, void* userdata) {
+    MovedTree* tree = userdata;
+    if (dir_entry->d_type == DT_DIR) return S_FTW_CONTINUE;
+
+    const char* relative = dest_relative(tree->watch, path);
+    char* old_path = replace_prefix(relative, tree->to, tree->from);
+    if (old_path == NULL) return S_FTW_CONTINUE;
+    Watch_clear_linked(tree->watch, old_path);
+    Watch_set_linked(tree->watch, relative, dir_entry->d_ino);
+    free(old_path);
+    return S_FTW_CONTINUE;
+}
+
+/// A directory within the source was renamed, so the destination directory is renamed to match,
+/// and any paths already recorded within it are moved along with it.
+/// The destination is only renamed if everything in it came from the source, so nothing else is moved.
+static void Watch_move_directory(Watch* watch, const char* from, const char* to) {
+    debug_printf("watch: move '%s' -> '%s'\n", from, to);
+    bool renamed = Watch_is_mirrored_tree(watch, from) &&
+                   renameat2(watch->dest_fd, from, watch->dest_fd, to, RENAME_NOREPLACE) == 0;
+    if (!renamed) {
+        // Remove what was mirrored at the old location, and mirror the new one instead
+        Watch_forget_tree(watch, from);
+        Watch_watch_tree(watch, to);
+        Watch_mark_dirty(watch, to);
+        return;
+    }
+
+    char dest_path[MAX_PATH_LEN];
+    if (join_path(dest_path, watch->dest_dir, to)) {
+        MovedTree tree = {.watch = watch, .from = from, .to = to};
+        simple_ftw(dest_path, &move_linked, &tree);
+    }
+
+    for (int wd = 0; wd < watch->wd_cap; wd++) {
+        char* path = watch->wd_paths[wd];
+        if (path == NULL || !is_within(from, path)) continue;
+        watch->wd_paths[wd] = replace_prefix(path, from, to);
+        free(path);
+    }
+
+    StringListIter iter = StringList_iterate(&watch->dirty);
+    unsigned int count = watch->dirty_count;
+    for (unsigned int i = 0; i < count; i++) {
+        char* path = StringListIter_next(&iter);
+        if (!is_within(from, path)) continue;
+        char* moved = replace_prefix(path, from, to);
+        if (moved == NULL) continue;
+        Watch_mark_dirty(watch, moved);
+        free(moved);
+    }
+}
+
+/// The directory moved away wasn't moved elsewhere within the source, so it's treated as deleted
+static void Watch_flush_move(Watch* watch) {
+    if (!watch->move_pending) return;
+    Watch_forget_tree(watch, watch->move_from);
+    watch->move_pending = false;
+}
+
+static void Watch_handle_event(Watch* watch, const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        watch->overflowed = true;
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watch->wd_cap || watch->wd_paths[event->wd] == NULL) return;
+    if (event->mask & IN_IGNORED) {
+        free(watch->wd_paths[event->wd]);
+        watch->wd_paths[event->wd] = NULL;
+        return;
+    }
+    if (event->len == 0) return;
+
+    char relative[MAX_PATH_LEN];
+    if (!join_path(relative, watch->wd_paths[event->wd], event->name)) return;
+    debug_printf("watch: event %x '%s'\n", event->mask, relative);
+    bool is_dir = event->mask & IN_ISDIR;
+
+    if (watch->move_pending) {
+        if (is_dir && (event->mask & IN_MOVED_TO) && event->cookie == watch->move_cookie) {
+            watch->move_pending = false;
+            Watch_move_directory(watch, watch->move_from, relative);
+            return;
+        }
+        Watch_flush_move(watch);
+    }
+
+    if (is_dir && (event->mask & IN_MOVED_FROM)) {
+        watch->move_pending = true;
+        watch->move_cookie = event->cookie;
+        memcpy(watch->move_from, relative, sizeof(relative));
+        return;
+    }
+    if (is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO))) Watch_watch_tree(watch, relative);
+    Watch_mark_dirty(watch, relative);
+}
+
+/// Reads one buffer of events from inotify
+///
+/// Returns 0 on success, otherwise errno
+static int Watch_read_events(Watch* watch) {
+    char buf[WATCH_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(watch->inotify_fd, buf, sizeof(buf));
+    if (len == -1) return errno == EINTR ? 0 : errno;
+
+    const struct inotify_event* event;
+    for (char* ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event*)ptr;
+        Watch_handle_event(watch, event);
+    }
+    return 0;
+}
+
+/// Returns true if path in the destination is already a hardlink of path in the source
+static bool Watch_is_linked(const Watch* watch, const char* path) {
+    struct stat src_st;
+    struct stat dest_st;
+    if (fstatat(watch->src_fd, path, &src_st, AT_SYMLINK_NOFOLLOW) == -1) return false;
+    if (fstatat(watch->dest_fd, path, &dest_st, AT_SYMLINK_NOFOLLOW) == -1) return false;
+    return src_st.st_dev == dest_st.st_dev && src_st.st_ino == dest_st.st_ino;
+}
+
+static void Watch_report(Watch* watch, char* path, int result) {
+    if (watch->cb != NULL) watch->cb(path, result, watch->userdata);
+}
+
+/// For each result in the completion queue, calls cb
+/// Paths that no longer exist are expected, as the source can change while a batch is applied,
+/// and files that are already linked are successes
+static void Watch_handle_results(Watch* watch) {
+    struct io_uring_cqe* cqe;
+    while (io_uring_peek_cqe(&watch->ring, &cqe) == 0) {
+        char* path = io_uring_cqe_get_data(cqe);
+        int result = -cqe->res;
+        if (result == ENOENT) result = 0;
+        if (result == EEXIST && Watch_is_linked(watch, path)) result = 0;
+        Watch_report(watch, path, result);
+        watch->in_flight -= 1;
+        io_uring_cqe_seen(&watch->ring, cqe);
+    }
+}
+
+/// Blocks until every queued operation has completed
+static void Watch_drain(Watch* watch) {
+    io_uring_submit(&watch->ring);
+    while (watch->in_flight > 0) {
+        struct io_uring_cqe* cqe;
+        io_uring_wait_cqe(&watch->ring, &cqe);
+        Watch_handle_results(watch);
+    }
+}
+
+static struct io_uring_sqe* Watch_get_sqe(Watch* watch) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&watch->ring);
+    // get_sqe returns NULL when the queue is full
+    while (sqe == NULL) {
+        io_uring_submit(&watch->ring);
+        Watch_handle_results(watch);
+        sqe = io_uring_get_sqe(&watch->ring);
+    }
+    watch->in_flight += 1;
+    return sqe;
+}
+
+/// Unlinks every path in watch->unlinks from the destination, and waits for them to complete
+static void Watch_apply_unlinks(Watch* watch) {
+    StringListIter iter = StringList_iterate(&watch->unlinks);
+    char* path;
+    while ((path = StringListIter_next(&iter)) != NULL) {
+        struct io_uring_sqe* sqe = Watch_get_sqe(watch);
+        io_uring_prep_unlinkat(sqe, watch->dest_fd, path, 0);
+        io_uring_sqe_set_data(sqe, path);
+    }
+    Watch_drain(watch);
+}
+
+/// Links every path in watch->links from the source to the destination, and waits for them to complete
+static void Watch_apply_links(Watch* watch) {
+    StringListIter iter = StringList_iterate(&watch->links);
+    char* path;
+    while ((path = StringListIter_next(&iter)) != NULL) {
+        struct io_uring_sqe* sqe = Watch_get_sqe(watch);
+        io_uring_prep_linkat(sqe, watch->src_fd, path, watch->dest_fd, path, 0);
+        io_uring_sqe_set_data(sqe, path);
+    }
+    Watch_drain(watch);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int compare_paths_reverse(const void* a, const void* b) {
+    return compare_paths(b, a);
+}
+
+/// Removes every directory in watch->removed_dirs from the destination, deepest first.
+/// Directories that still hold files that didn't come from the source aren't empty, so they remain.
+static void Watch_apply_removed_dirs(Watch* watch) {
+    if (watch->removed_dir_count == 0) return;
+    char** dirs = malloc(watch->removed_dir_count * sizeof(char*));
+    if (dirs == NULL) return;
+
+    StringListIter iter = StringList_iterate(&watch->removed_dirs);
+    for (unsigned int i = 0; i < watch->removed_dir_count; i++) dirs[i] = StringListIter_next(&iter);
+    // Reverse order puts every directory before its parent
+    qsort(dirs, watch->removed_dir_count, sizeof(char*), &compare_paths_reverse);
+    for (unsigned int i = 0; i < watch->removed_dir_count; i++) {
+        debug_printf("watch: remove directory '%s'\n", dirs[i]);
+        unlinkat(watch->dest_fd, dirs[i], AT_REMOVEDIR);
+    }
+    free(dirs);
+}
+
+/// The source directory at relative was removed.
+/// Queues the unlink of every file directly within the destination directory that was linked from the source,
+/// and its removal once empty. Subdirectories aren't entered; those from the source are changed paths themselves.
+static void Watch_remove_directory(Watch* watch, const char* relative) {
+    StringList_add_nullterm(&watch->removed_dirs, relative);
+    watch->removed_dir_count += 1;
+
+    int dir_fd = openat(watch->dest_fd, relative, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd == -1) return;
+    DIR* dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        close(dir_fd);
+        return;
+    }
+
+    struct dirent* ent;
+    struct stat st;
+    char path[MAX_PATH_LEN];
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_type == DT_DIR) continue;
+        if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (!join_path(path, relative, ent->d_name)) continue;
+        if (!Watch_is_mirrored(watch, path, &st)) continue;
+        StringList_add_nullterm(&watch->unlinks, path);
+        Watch_clear_linked(watch, path);
+    }
+    closedir(dir);
+}
+
+/// simple_ftw callback
+/// Creates each directory in the destination, and queues a link for each file
+static simple_ftw_sig mirror_entry(const struct dirent* dir_entry, const char* path, unsigned int path_len, void* userdata) {
+    Watch* watch = userdata;
+    const char* relative = path + watch->src_dir_len;
+    while (relative[0] == '/') relative += 1;
+
+    struct stat st;
+    switch (dir_entry->d_type) {
+        case DT_DIR:
+            if (fstatat(watch->src_fd, relative, &st, AT_SYMLINK_NOFOLLOW) == -1) break;
+            mkdirat(watch->dest_fd, relative, st.st_mode);
+            break;
+        case DT_REG:
+            Watch_set_linked(watch, relative, dir_entry->d_ino);
+            StringList_add_nullterm(&watch->links, relative);
+            break;
+    }
+    return S_FTW_CONTINUE;
+}
+
+/// Creates the directory at relative in the destination, and queues a link for every file within it.
+/// Directories are created immediately, so they exist before any link into them is submitted.
+static void Watch_mirror_directory(Watch* watch, const char* relative) {
+    char src_path[MAX_PATH_LEN];
+    if (!join_path(src_path, watch->src_dir, relative)) return;
+    debug_printf("watch: mirror '%s'\n", src_path);
+
+    if (relative[0] != 0) {
+        struct stat st;
+        if (fstatat(watch->src_fd, relative, &st, AT_SYMLINK_NOFOLLOW) == -1) return;
+        mkdirat(watch->dest_fd, relative, st.st_mode);
+    }
+    simple_ftw(src_path, &mirror_entry, watch);
+}
+
+/// Works out what is needed to make the destination at relative match the source, and queues it.
+/// Anything in the destination that didn't come from the source is left alone, and reported as EEXIST.
+///
+/// Returns true if everything within relative was handled as well
+static bool Watch_apply_path(Watch* watch, char* relative) {
+    if (strcmp(relative, WATCH_ROOT) == 0) {
+        Watch_mirror_directory(watch, "");
+        return true;
+    }
+
+    struct stat src_st;
+    struct stat dest_st;
+    bool in_src = fstatat(watch->src_fd, relative, &src_st, AT_SYMLINK_NOFOLLOW) == 0;
+    bool in_dest = fstatat(watch->dest_fd, relative, &dest_st, AT_SYMLINK_NOFOLLOW) == 0;
+    bool src_is_dir = in_src && S_ISDIR(src_st.st_mode);
+    bool src_is_file = in_src && S_ISREG(src_st.st_mode);
+    bool dest_is_dir = in_dest && S_ISDIR(dest_st.st_mode);
+    bool dest_is_mirrored = in_dest && Watch_is_mirrored(watch, relative, &dest_st);
+    bool linked = in_dest && src_is_file && src_st.st_dev == dest_st.st_dev && src_st.st_ino == dest_st.st_ino;
+
+    if (linked) {
+        Watch_set_linked(watch, relative, src_st.st_ino);
+        return false;
+    }
+
+    if (dest_is_dir && !src_is_dir) {
+        Watch_remove_directory(watch, relative);
+        // Links are made after directories are removed, so a file can take the directory's place
+        if (src_is_file) {
+            Watch_set_linked(watch, relative, src_st.st_ino);
+            StringList_add_nullterm(&watch->links, relative);
+        }
+        return false;
+    }
+
+    if (in_dest && !dest_is_dir && !dest_is_mirrored && (src_is_dir || src_is_file)) {
+        Watch_clear_linked(watch, relative);
+        Watch_report(watch, relative, EEXIST);
+        return src_is_dir;
+    }
+
+    Watch_clear_linked(watch, relative);
+    if (src_is_dir) {
+        // The directory replaces it straight away, so this can't wait for the batch
+        if (in_dest && !dest_is_dir) unlinkat(watch->dest_fd, relative, 0);
+        Watch_mirror_directory(watch, relative);
+        return true;
+    }
+
+    if (dest_is_mirrored) StringList_add_nullterm(&watch->unlinks, relative);
+    if (src_is_file) {
+        Watch_set_linked(watch, relative, src_st.st_ino);
+        StringList_add_nullterm(&watch->links, relative);
+    }
+    return false;
+}
+
+/// Applies every path changed since the last batch, then clears them.
+/// Every unlink in the batch is submitted together, then directories are removed, then every link is submitted together.
+static void Watch_apply(Watch* watch) {
+    debug_printf("watch: applying %u changes\n", watch->dirty_count);
+    char** paths = malloc(watch->dirty_count * sizeof(char*));
+    if (paths == NULL) return;
+
+    StringListIter iter = StringList_iterate(&watch->dirty);
+    for (unsigned int i = 0; i < watch->dirty_count; i++) paths[i] = StringListIter_next(&iter);
+    // Sorting removes duplicates, and puts every directory before anything within it
+    qsort(paths, watch->dirty_count, sizeof(char*), &compare_paths);
+
+    const char* handled_dir = NULL;
+    for (unsigned int i = 0; i < watch->dirty_count; i++) {
+        if (i > 0 && strcmp(paths[i], paths[i - 1]) == 0) continue;
+        if (handled_dir != NULL && is_within(handled_dir, paths[i])) continue;
+        if (Watch_apply_path(watch, paths[i])) handled_dir = strcmp(paths[i], WATCH_ROOT) == 0 ? "" : paths[i];
+    }
+
+    Watch_apply_unlinks(watch);
+    Watch_apply_removed_dirs(watch);
+    Watch_apply_links(watch);
+
+    free(paths);
+    StringList_free(&watch->dirty);
+    StringList_free(&watch->unlinks);
+    StringList_free(&watch->removed_dirs);
+    StringList_free(&watch->links);
+    watch->dirty_count = 0;
+    watch->removed_dir_count = 0;
+}
+
+int Watch_open(Watch* watch, const char* src_dir, const char* dest_dir, lndir_callback_t cb, void* userdata) {
+    memset(watch, 0, sizeof(*watch));
+    watch->src_fd = -1;
+    watch->dest_fd = -1;
+    watch->src_dir = src_dir;
+    watch->dest_dir = dest_dir;
+    watch->src_dir_len = strlen(src_dir);
+    watch->cb = cb;
+    watch->userdata = userdata;
+
+    watch->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (watch->inotify_fd == -1) return errno;
+
+    int result = io_uring_queue_init(MAX_SQE, &watch->ring, 0);
+    if (result != 0) {
+        close(watch->inotify_fd);
+        return -result;
+    }
+
+    struct stat st;
+    watch->src_fd = open(src_dir, O_DIRECTORY | O_CLOEXEC);
+    if (watch->src_fd == -1 || fstat(watch->src_fd, &st) == -1) {
+        result = errno;
+        Watch_close(watch);
+        return result;
+    }
+    watch->src_dev = st.st_dev;
+
+    Watch_watch_tree(watch, "");
+    if (watch->add_error != 0) {
+        result = watch->add_error;
+        Watch_close(watch);
+        return result;
+    }
+    return 0;
+}
+
+int Watch_step(Watch* watch, int timeout_ms) {
+    if (watch->dest_fd == -1) {
+        watch->dest_fd = open(watch->dest_dir, O_DIRECTORY | O_CLOEXEC);
+        if (watch->dest_fd == -1) return errno;
+    }
+
+    struct pollfd pfd = {.fd = watch->inotify_fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready == -1) return errno == EINTR ? 0 : errno;
+    if (ready == 0) return 0;
+
+    int result = Watch_read_events(watch);
+    if (result != 0) return result;
+
+    // keep collecting events until they stop arriving
+    while (watch->dirty_count < WATCH_MAX_BATCH && poll(&pfd, 1, WATCH_COALESCE_MS) > 0) {
+        result = Watch_read_events(watch);
+        if (result != 0) return result;
+    }
+    Watch_flush_move(watch);
+
+    if (watch->overflowed) {
+        // Events were lost, so everything is mirrored again.
+        // Files deleted while events were lost remain in the destination.
+        debug_printf("watch: event queue overflowed\n");
+        Watch_watch_tree(watch, "");
+        Watch_mark_dirty(watch, WATCH_ROOT);
+        watch->overflowed = false;
+    }
+    if (watch->dirty_count > 0) Watch_apply(watch);
+    return 0;
+}
+
+int Watch_run(Watch* watch) {
+    while (true) {
+        int result = Watch_step(watch, -1);
+        if (result != 0) return result;
+    }
+}
+
+void Watch_close(Watch* watch) {
+    if (watch->src_fd != -1) close(watch->src_fd);
+    if (watch->dest_fd != -1) close(watch->dest_fd);
+    close(watch->inotify_fd);
+    io_uring_queue_exit(&watch->ring);
+    for (int wd = 0; wd < watch->wd_cap; wd++) free(watch->wd_paths[wd]);
+    free(watch->wd_paths);
+    watch->wd_paths = NULL;
+    watch->wd_cap = 0;
+    free(watch->linked);
+    watch->linked = NULL;
+    watch->linked_len = 0;
+    watch->linked_cap = 0;
+    StringList_free(&watch->dirty);
+    StringList_free(&watch->unlinks);
+    StringList_free(&watch->removed_dirs);
+    StringList_free(&watch->links);
+    watch->dirty_count = 0;
+    watch->removed_dir_count = 0;
+}
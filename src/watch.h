@@ -0,0 +1,119 @@
+/*
+ * Keeps a destination directory in sync with its source, after the initial lndir run.
+ *
+ * Every directory in the source is watched with inotify.
+ * Events are coalesced into batches; rather than replaying each event, every path touched in a batch
+ * is compared between the source and the destination, and the differences are applied with io_uring.
+ * Because of this, a file created and deleted within the same batch costs nothing,
+ * and the cost of keeping the mirror current depends on the rate of change rather than the size of the tree.
+ *
+ * The destination may hold files that didn't come from the source, e.g. when mirroring dotfiles into $HOME.
+ * Each path the mirror links is recorded with the inode linked there, and a destination file is only
+ * replaced or removed if that path still holds that inode. Directories are only removed once empty.
+ * Any other conflict is reported to the callback as EEXIST.
+*/
+
+/** Example Usage
+Watch watch;
+// Watches are added before the initial run, so no change is missed in between
+if (Watch_open(&watch, src_dir, dest_dir, cb, userdata) != 0) // ...
+hardlink_directory_structure(src_dir, dest_dir, cb, userdata);
+
+// Blocks, applying changes until an error occurs
+int err = Watch_run(&watch);
+Watch_close(&watch);
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "dir_walker.h"
+#include "lndir.h"
+#include "string_list.h"
+
+/// A path in the destination, and the source inode the mirror linked there
+struct WatchLink {
+    uint64_t path_hash;
+    ino_t ino; // 0 if the slot is empty
+};
+typedef struct WatchLink WatchLink;
+
+struct Watch {
+    int inotify_fd;
+    int src_fd;
+    int dest_fd;
+    dev_t src_dev;
+    const char* src_dir;
+    const char* dest_dir;
+    unsigned int src_dir_len;
+    int add_error; // errno of the first watch that couldn't be added
+
+    // The path of each watched directory relative to src_dir, indexed by watch descriptor
+    char** wd_paths;
+    int wd_cap;
+
+    // Every path linked from the source that is still in the destination; an open addressing hash map.
+    // Paths are stored as a 64 bit hash, as there is one per mirrored file.
+    WatchLink* linked;
+    unsigned int linked_len;
+    unsigned int linked_cap;
+
+    // Paths changed since the last batch was applied, relative to src_dir
+    StringList dirty;
+    unsigned int dirty_count;
+    bool overflowed;
+
+    // A directory moved away, which is a rename if the matching IN_MOVED_TO follows
+    bool move_pending;
+    unsigned int move_cookie;
+    char move_from[MAX_PATH_LEN];
+
+    // Work for the batch being applied: unlinks, then removing directories, then links
+    StringList unlinks;
+    StringList removed_dirs;
+    unsigned int removed_dir_count;
+    StringList links;
+
+    struct io_uring ring;
+    unsigned int in_flight;
+    lndir_callback_t cb;
+    void* userdata;
+};
+typedef struct Watch Watch;
+
+/*
+ * Starts watching every directory in src_dir.
+ * Changes are queued from this point, and applied to dest_dir by Watch_step or Watch_run.
+ * If cb is not NULL, it is called for each link and unlink result.
+ *
+ * Returns 0 on success, otherwise errno
+*/
+int Watch_open(Watch* watch, const char* src_dir, const char* dest_dir, lndir_callback_t cb, void* userdata);
+
+/*
+ * Waits up to timeout_ms for changes in the source directory (forever if negative),
+ * then collects one batch of changes and applies it to the destination.
+ * dest_dir must already exist and mirror src_dir, e.g. from hardlink_directory_structure.
+ *
+ * Returns 0 on success, including if nothing changed, otherwise errno
+*/
+int Watch_step(Watch* watch, int timeout_ms);
+
+/*
+ * Calls Watch_step forever.
+ *
+ * Only returns if reading events fails, returning errno
+*/
+int Watch_run(Watch* watch);
+
+/*
+ * Removes all watches and frees all memory
+*/
+void Watch_close(Watch* watch);
+
+#endif